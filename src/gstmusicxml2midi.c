@@ -63,8 +63,10 @@
 #endif
 
 #include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
 #include <string.h>
 #include <math.h>
+#include <libxml/SAX2.h>
 
 #include "gstmusicxml2midi.h"
 
@@ -73,6 +75,65 @@ GST_DEBUG_CATEGORY_STATIC (gst_musicxml2midi_debug);
 
 #define TIME_DIVISION 384
 
+/* Static tracepoints, compiled to a single nop each when enabled and
+ * to nothing otherwise. List them with: perf list 'sdt_musicxml2midi:*' */
+#ifdef ENABLE_SDT_PROBES
+#  include <sys/sdt.h>
+#  define TRACE2(name, a, b) DTRACE_PROBE2(musicxml2midi, name, a, b)
+#  define TRACE3(name, a, b, c) DTRACE_PROBE3(musicxml2midi, name, a, b, c)
+#else
+#  define TRACE2(name, a, b) G_STMT_START { (void) (a); (void) (b); } G_STMT_END
+#  define TRACE3(name, a, b, c) G_STMT_START { (void) (a); (void) (b); (void) (c); } G_STMT_END
+#endif
+
+/* Dictionary shared by the parser contexts of every musicxml2midi instance.
+ * It is created once when the plugin is loaded, pre-populated with the
+ * MusicXML element names we look for and never modified afterwards, so each
+ * instance only needs a small private sub-dictionary for the remaining
+ * strings in its document. */
+static xmlDictPtr musicxml2midi_dict = NULL;
+
+enum
+{
+  NAME_SCORE_TIMEWISE,
+  NAME_PART_LIST,
+  NAME_SCORE_PART,
+  NAME_MIDI_INSTRUMENT,
+  NAME_MIDI_CHANNEL,
+  NAME_MIDI_PROGRAM,
+  NAME_PART,
+  NAME_MEASURE,
+  NAME_ATTRIBUTES,
+  NAME_DIVISIONS,
+  NAME_TIME,
+  NAME_BEATS,
+  NAME_BEAT_TYPE,
+  NAME_KEY,
+  NAME_FIFTHS,
+  NAME_NOTE,
+  NAME_DURATION,
+  NAME_REST,
+  NAME_PITCH,
+  NAME_STEP,
+  NAME_OCTAVE,
+  NAME_ALTER,
+  N_NAMES
+};
+
+static const gchar *musicxml2midi_names[N_NAMES] = {
+  "score-timewise", "part-list", "score-part", "midi-instrument",
+  "midi-channel", "midi-program", "part", "measure", "attributes",
+  "divisions", "time", "beats", "beat-type", "key", "fifths", "note",
+  "duration", "rest", "pitch", "step", "octave", "alter"
+};
+
+/* The same names as owned by musicxml2midi_dict. Documents are parsed with
+ * a sub-dictionary of it, whose lookups return these pointers, so element
+ * names can be matched by pointer rather than by string comparison */
+static const xmlChar *musicxml2midi_interned[N_NAMES];
+
+#define IS_NAMED(node, id) ((node)->name == musicxml2midi_interned[id])
+
 /* Filter signals and args */
 enum
 {
@@ -82,7 +143,10 @@ enum
 
 enum
 {
-  PROP_0
+  PROP_0,
+  PROP_MAX_DOCUMENT_BYTES,
+  PROP_MAX_DOM_NODES,
+  PROP_MAX_EVENTS
 };
 
 /* the capabilities of the inputs and outputs.
@@ -109,19 +173,46 @@ static void gst_musicxml2midi_set_property (GObject * object, guint prop_id,
 static void gst_musicxml2midi_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
 
+static void gst_musicxml2midi_finalize (GObject * object);
+static void create_parser (GstMusicXml2Midi * filter);
+static void free_state (GstMusicXml2Midi * filter);
+static void reset_state (GstMusicXml2Midi * filter);
+
+static GstStateChangeReturn gst_musicxml2midi_change_state (GstElement * element,
+    GstStateChange transition);
+
 static gboolean gst_musicxml2midi_set_caps (GstPad * pad, GstCaps * caps);
 static GstFlowReturn gst_musicxml2midi_chain (GstPad * pad, GstBuffer * buf);
 static gboolean gst_musicxml2midi_sink_event (GstPad * pad, GstEvent * event);
 static Track *get_track_by_part (GstMusicXml2Midi * filter, xmlChar * part_id);
-static GstBuffer *process_element(GstMusicXml2Midi * filter, xmlNode * node);
+static guint process_element(GstMusicXml2Midi * filter, xmlNode * node, GstBufferListIterator * it);
 static GstBuffer *process_partlist(GstMusicXml2Midi * filter, xmlNode * node);
 static GstBuffer *process_part(GstMusicXml2Midi * filter, xmlNode * node);
+static guint process_timewise(GstMusicXml2Midi * filter, xmlNode * node, GstBufferListIterator * it);
+static void process_measure(GstMusicXml2Midi * filter, xmlNode * node, Track * t, GByteArray * data);
+static GByteArray *start_track_chunk(void);
+static GstBuffer *finish_track_chunk(GstMusicXml2Midi * filter, GByteArray * data);
 static void process_score_part(GstMusicXml2Midi * filter, xmlNode * node);
-static GstBuffer *process_attributes(GstMusicXml2Midi * filter, xmlNode * node, Track *t);
-static GstBuffer *process_time(GstMusicXml2Midi * filter, xmlNode * node);
-static GstBuffer *process_key(GstMusicXml2Midi * filter, xmlNode * node);
-static GstBuffer *process_note(GstMusicXml2Midi * filter, xmlNode * node, Track * track);
-static GstBuffer *get_vlv(guint32 val);
+static gboolean process_attributes(GstMusicXml2Midi * filter, xmlNode * node, Track *t, GByteArray * data);
+static gboolean process_time(GstMusicXml2Midi * filter, xmlNode * node, GByteArray * data);
+static gboolean process_key(GstMusicXml2Midi * filter, xmlNode * node, GByteArray * data);
+static void process_note(GstMusicXml2Midi * filter, xmlNode * node, Track * track, GByteArray * data);
+static void append_vlv(GByteArray * data, guint32 val);
+static void count_events(GstMusicXml2Midi * filter, guint n);
+static int get_node_int(GstMusicXml2Midi * filter, xmlNode * node);
+static guint8 get_node_char(GstMusicXml2Midi * filter, xmlNode * node);
+static gboolean count_dom_nodes(xmlParserCtxtPtr ctxt, guint n);
+static void sax_start_element_ns(void *ctx, const xmlChar * localname,
+    const xmlChar * prefix, const xmlChar * URI, int nb_namespaces,
+    const xmlChar ** namespaces, int nb_attributes, int nb_defaulted,
+    const xmlChar ** attributes);
+static void sax_characters(void *ctx, const xmlChar * ch, int len);
+static void sax_cdata_block(void *ctx, const xmlChar * value, int len);
+static void sax_comment(void *ctx, const xmlChar * value);
+static void sax_processing_instruction(void *ctx, const xmlChar * target,
+    const xmlChar * data);
+static void sax_entity_decl(void *ctx, const xmlChar * name, int type,
+    const xmlChar * publicId, const xmlChar * systemId, xmlChar * content);
 
 
 /* GObject vmethod implementations */
@@ -155,6 +246,22 @@ gst_musicxml2midi_class_init (GstMusicXml2MidiClass * klass)
 
   gobject_class->set_property = gst_musicxml2midi_set_property;
   gobject_class->get_property = gst_musicxml2midi_get_property;
+  gobject_class->finalize = gst_musicxml2midi_finalize;
+
+  gstelement_class->change_state = gst_musicxml2midi_change_state;
+
+  g_object_class_install_property (gobject_class, PROP_MAX_DOCUMENT_BYTES,
+      g_param_spec_uint64 ("max-document-bytes", "Maximum document bytes",
+          "Reject documents larger than this many bytes (0 = unlimited)",
+          0, G_MAXUINT64, 0, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_MAX_DOM_NODES,
+      g_param_spec_uint ("max-dom-nodes", "Maximum DOM nodes",
+          "Reject documents with more than this many nodes: elements, attributes, namespace declarations, text, comments and processing instructions (0 = unlimited)",
+          0, G_MAXUINT, 0, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_MAX_EVENTS,
+      g_param_spec_uint ("max-events", "Maximum events",
+          "Reject scores producing more than this many MIDI events (0 = unlimited)",
+          0, G_MAXUINT, 0, G_PARAM_READWRITE));
 }
 
 /* initialize the new element
@@ -178,18 +285,105 @@ gst_musicxml2midi_init (GstMusicXml2Midi * filter,
 
   gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
   gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
+  filter->ctxt = NULL;
+  filter->first_track = NULL;
+
+  filter->max_document_bytes = 0;
+  filter->max_dom_nodes = 0;
+  filter->max_events = 0;
+
+  reset_state(filter);
+}
+
+/* Create the push parser for a new document */
+static void
+create_parser (GstMusicXml2Midi * filter)
+{
   filter->ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+
+  /* Swap the context's private dictionary for a child of the shared one,
+   * the predefined names have to be looked up again in the new dictionary */
+  xmlDictFree(filter->ctxt->dict);
+  filter->ctxt->dict = xmlDictCreateSub(musicxml2midi_dict);
+  filter->ctxt->dictNames = 1;
+  filter->ctxt->str_xml = xmlDictLookup(filter->ctxt->dict, BAD_CAST "xml", 3);
+  filter->ctxt->str_xmlns = xmlDictLookup(filter->ctxt->dict, BAD_CAST "xmlns", 5);
+  filter->ctxt->str_xml_ns = xmlDictLookup(filter->ctxt->dict, XML_XML_NAMESPACE, 36);
+
+  /* Never touch the network and keep entity references unexpanded */
+  xmlCtxtUseOptions(filter->ctxt, XML_PARSE_NONET);
+
+  /* Count nodes as the tree is built and refuse entity declarations */
+  filter->ctxt->_private = filter;
+  filter->ctxt->sax->startElementNs = sax_start_element_ns;
+  filter->ctxt->sax->characters = sax_characters;
+  if (filter->ctxt->sax->ignorableWhitespace == xmlSAX2Characters) {
+    filter->ctxt->sax->ignorableWhitespace = sax_characters;
+  }
+  filter->ctxt->sax->cdataBlock = sax_cdata_block;
+  filter->ctxt->sax->comment = sax_comment;
+  filter->ctxt->sax->processingInstruction = sax_processing_instruction;
+  filter->ctxt->sax->entityDecl = sax_entity_decl;
+}
+
+/* Release the tracks, the parsed document and the parser */
+static void
+free_state (GstMusicXml2Midi * filter)
+{
+  Track *t = filter->first_track;
+  Track *next;
+
+  while (t != NULL) {
+    next = t->next;
+    xmlFree(t->xml_id);
+    if (t->events != NULL) {
+      g_byte_array_free(t->events, TRUE);
+    }
+    free(t);
+    t = next;
+  }
   filter->first_track = NULL;
   filter->num_tracks = 0;
+
+  if (filter->ctxt != NULL) {
+    if (filter->ctxt->myDoc != NULL) {
+      xmlFreeDoc(filter->ctxt->myDoc);
+    }
+    xmlFreeParserCtxt(filter->ctxt);
+    filter->ctxt = NULL;
+  }
+}
+
+/* Get ready for a new document, forgetting the previous one and any
+ * rejection of it. The limits themselves are properties and are kept */
+static void
+reset_state (GstMusicXml2Midi * filter)
+{
+  free_state(filter);
+  create_parser(filter);
+
+  filter->document_bytes = 0;
+  filter->dom_nodes = 0;
+  filter->num_events = 0;
+  filter->reject_reason = NULL;
 }
 
 static void
 gst_musicxml2midi_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
 {
-//  GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (object);
+  GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (object);
 
   switch (prop_id) {
+    case PROP_MAX_DOCUMENT_BYTES:
+      filter->max_document_bytes = g_value_get_uint64 (value);
+      break;
+    case PROP_MAX_DOM_NODES:
+      filter->max_dom_nodes = g_value_get_uint (value);
+      break;
+    case PROP_MAX_EVENTS:
+      filter->max_events = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -200,17 +394,59 @@ static void
 gst_musicxml2midi_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec)
 {
-//  GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (object);
+  GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (object);
 
   switch (prop_id) {
+    case PROP_MAX_DOCUMENT_BYTES:
+      g_value_set_uint64 (value, filter->max_document_bytes);
+      break;
+    case PROP_MAX_DOM_NODES:
+      g_value_set_uint (value, filter->max_dom_nodes);
+      break;
+    case PROP_MAX_EVENTS:
+      g_value_set_uint (value, filter->max_events);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+static void
+gst_musicxml2midi_finalize (GObject * object)
+{
+  GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (object);
+
+  free_state(filter);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
 /* GstElement vmethod implementations */
 
+static GstStateChangeReturn
+gst_musicxml2midi_change_state (GstElement * element, GstStateChange transition)
+{
+  GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (element);
+  GstStateChangeReturn ret;
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+  if (ret == GST_STATE_CHANGE_FAILURE) {
+    return ret;
+  }
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* The instance may be reused for another document */
+      reset_state (filter);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
 /* this function handles the link with other elements */
 static gboolean
 gst_musicxml2midi_set_caps (GstPad * pad, GstCaps * caps)
@@ -225,33 +461,36 @@ gst_musicxml2midi_set_caps (GstPad * pad, GstCaps * caps)
   return gst_pad_set_caps (otherpad, caps);
 }
 
-/* Convert music xml to MIDI and push it to the src pad */
-static GstBuffer *
-process_element(GstMusicXml2Midi * filter, xmlNode * node)
+/* Convert music xml to MIDI, adding the MThd header and each MTrk chunk
+ * to the list as a group of its own. Returns the number of buffers added */
+static guint
+process_element(GstMusicXml2Midi * filter, xmlNode * node, GstBufferListIterator * it)
 {
   xmlNode *cur_node = NULL;
-  GstBuffer *buf = NULL;
   GstBuffer *elem_buf;
+  guint n_buffers = 0;
 
-  for (cur_node = node; cur_node; cur_node = cur_node->next) {
+  for (cur_node = node; cur_node && !filter->reject_reason; cur_node = cur_node->next) {
     elem_buf = NULL;
     if (cur_node->type == XML_ELEMENT_NODE) {
-      if (xmlStrEqual(cur_node->name, (xmlChar *) "part")) {
+      if (IS_NAMED(cur_node, NAME_PART)) {
         elem_buf = process_part(filter, cur_node);
-      } else if (xmlStrEqual(cur_node->name, (xmlChar *) "part-list")) {
+      } else if (IS_NAMED(cur_node, NAME_PART_LIST)) {
         elem_buf = process_partlist(filter, cur_node);
+      } else if (IS_NAMED(cur_node, NAME_SCORE_TIMEWISE)) {
+        n_buffers += process_timewise(filter, cur_node->children, it);
       } else {
-        elem_buf = process_element(filter, cur_node->children);
+        n_buffers += process_element(filter, cur_node->children, it);
       }
     }
-    if (buf == NULL) {
-      buf = elem_buf;
-    } else if (elem_buf != NULL) {
-      buf = gst_buffer_join(buf, elem_buf);
+    if (elem_buf != NULL) {
+      gst_buffer_list_iterator_add_group(it);
+      gst_buffer_list_iterator_add(it, elem_buf);
+      n_buffers++;
     }
   }
 
-  return buf;
+  return n_buffers;
 }
 
 
@@ -265,7 +504,7 @@ process_partlist(GstMusicXml2Midi * filter, xmlNode * node)
   guint16 *data16 = (guint16 *) GST_BUFFER_DATA(buf);
 
   while (child_node != NULL) {
-    if (xmlStrEqual(child_node->name, (xmlChar *) "score-part")) {
+    if (IS_NAMED(child_node, NAME_SCORE_PART)) {
       process_score_part(filter, child_node);
       num_tracks++;
     }
@@ -287,64 +526,162 @@ static GstBuffer *
 process_part(GstMusicXml2Midi * filter, xmlNode * node)
 {
   xmlNode *child_node = node->children;
-  xmlNode *measure_node;
   xmlChar *part_id = xmlGetProp(node, (xmlChar *) "id");
-  GstBuffer *buf = gst_buffer_new_and_alloc(8);
-  char *data = (char *) GST_BUFFER_DATA(buf);
-  GstBuffer *note_buf = NULL;
-  GstBuffer *tmp_buf = NULL;
-  GstBuffer *end_buf = gst_buffer_new_and_alloc(4);
-  guint8 *end_data = GST_BUFFER_DATA(end_buf);
-
-  memset(data, 0, 8);
-  data[0] = 'M'; data[1] = 'T'; data[2] = 'r'; data[3] = 'k'; /* MTrk - MIDI Track Header */
-  end_data[0] = 0x00; end_data[1] = 0xff; end_data[2] = 0x2f; end_data[3] = 0x00; /* End of track event */
+  GByteArray *data;
+  GstBuffer *buf;
+  guint first_event = filter->num_events;
 
   Track *t = get_track_by_part(filter, part_id);
   if (t == NULL) {
     GST_WARNING("No score-part associated with this part. This part will not be heard.");
-    return buf;
+    xmlFree(part_id);
+    return NULL;
   }
 
-  while (child_node != NULL) {
-    if (xmlStrEqual(child_node->name, (xmlChar *) "measure")) {
-        measure_node = child_node->children;
-        while (measure_node != NULL) {
-          tmp_buf = NULL;
-          if (xmlStrEqual(measure_node->name, (xmlChar *) "attributes")) {
-            tmp_buf = process_attributes(filter, measure_node, t);
-            if (tmp_buf == NULL) {
-              measure_node = measure_node->next;
-              continue;
-            }
-            /* Set patch after attributes */
-            GstBuffer *patch_buf = gst_buffer_new_and_alloc(3);
-            guint8 *patch_data = GST_BUFFER_DATA(patch_buf);
-            patch_data[0] = 0; /* Delta time */
-            patch_data[1] = 0xc0 | t->midi_channel; /* Set patch on channel */
-            patch_data[2] = t->midi_instrument;
-            tmp_buf = gst_buffer_join(tmp_buf, patch_buf);
-          } else if (xmlStrEqual(measure_node->name, (xmlChar *) "note")) {
-            tmp_buf = process_note(filter, measure_node, t);
-          }
-          
-          if (note_buf == NULL) {
-            note_buf = tmp_buf;
-          } else if (tmp_buf != NULL) {
-            note_buf = gst_buffer_join(note_buf, tmp_buf);
-          }
-          measure_node = measure_node->next;
-        }
+  TRACE2(part_begin, filter, part_id);
+
+  data = start_track_chunk();
+  while (child_node != NULL && !filter->reject_reason) {
+    if (IS_NAMED(child_node, NAME_MEASURE)) {
+      process_measure(filter, child_node, t, data);
     }
     child_node = child_node->next;
   }
 
-  note_buf = gst_buffer_join(note_buf, end_buf);
+  buf = finish_track_chunk(filter, data);
+
+  TRACE3(part_end, filter, part_id, filter->num_events - first_event);
+  xmlFree(part_id);
+
+  return buf;
+}
+
 
-  guint32 *header = (guint32 *) GST_BUFFER_DATA(buf);
-  header[1] = g_htonl(GST_BUFFER_SIZE(note_buf));
+/* score-timewise nests parts inside measures, so a single pass over the
+ * measures appends each part's events to its track, which are only
+ * added to the list as MTrk chunks once the whole score has been read */
+static guint
+process_timewise(GstMusicXml2Midi * filter, xmlNode * node, GstBufferListIterator * it)
+{
+  xmlNode *child_node;
+  xmlNode *part_node;
+  xmlChar *part_id;
+  GstBuffer *buf;
+  guint n_buffers = 0;
+  guint first_event;
+  Track *t;
+
+  for (child_node = node; child_node && !filter->reject_reason; child_node = child_node->next) {
+    if (IS_NAMED(child_node, NAME_PART_LIST)) {
+      gst_buffer_list_iterator_add_group(it);
+      gst_buffer_list_iterator_add(it, process_partlist(filter, child_node));
+      n_buffers++;
+    } else if (IS_NAMED(child_node, NAME_MEASURE)) {
+      for (part_node = child_node->children; part_node && !filter->reject_reason; part_node = part_node->next) {
+        if (!IS_NAMED(part_node, NAME_PART)) {
+          continue;
+        }
+        part_id = xmlGetProp(part_node, (xmlChar *) "id");
+        t = get_track_by_part(filter, part_id);
+        xmlFree(part_id);
+        if (t == NULL) {
+          GST_WARNING("No score-part associated with this part. This part will not be heard.");
+          continue;
+        }
 
-  buf = gst_buffer_join(buf, note_buf);
+        if (t->events == NULL) {
+          TRACE2(part_begin, filter, t->xml_id);
+          t->events = start_track_chunk();
+          t->num_events = 0;
+        }
+        first_event = filter->num_events;
+        process_measure(filter, part_node, t, t->events);
+        t->num_events += filter->num_events - first_event;
+      }
+    }
+  }
+
+  /* Emit the tracks in part-list order, as partwise scores list them */
+  for (t = filter->first_track; t != NULL; t = t->next) {
+    if (t->events == NULL) {
+      continue;
+    }
+    first_event = filter->num_events;
+    buf = finish_track_chunk(filter, t->events);
+    t->events = NULL;
+    t->num_events += filter->num_events - first_event;
+    TRACE3(part_end, filter, t->xml_id, t->num_events);
+
+    if (filter->reject_reason) {
+      gst_buffer_unref(buf);
+    } else {
+      gst_buffer_list_iterator_add_group(it);
+      gst_buffer_list_iterator_add(it, buf);
+      n_buffers++;
+    }
+  }
+
+  return n_buffers;
+}
+
+
+/* Convert the contents of a single measure of a part, node is the
+ * <measure> of a partwise score or the <part> of a timewise one */
+static void
+process_measure(GstMusicXml2Midi * filter, xmlNode * node, Track * t, GByteArray * data)
+{
+  xmlNode *measure_node = node->children;
+
+  while (measure_node != NULL && !filter->reject_reason) {
+    if (IS_NAMED(measure_node, NAME_ATTRIBUTES)) {
+      if (process_attributes(filter, measure_node, t, data)) {
+        /* Set patch after attributes */
+        guint8 patch_data[3];
+        count_events(filter, 1);
+        patch_data[0] = 0; /* Delta time */
+        patch_data[1] = 0xc0 | t->midi_channel; /* Set patch on channel */
+        patch_data[2] = t->midi_instrument;
+        g_byte_array_append(data, patch_data, 3);
+      }
+    } else if (IS_NAMED(measure_node, NAME_NOTE)) {
+      process_note(filter, measure_node, t, data);
+    }
+    measure_node = measure_node->next;
+  }
+}
+
+
+/* Start a new MTrk chunk, its length is filled in by finish_track_chunk */
+static GByteArray *
+start_track_chunk(void)
+{
+  GByteArray *data = g_byte_array_sized_new(256);
+  guint8 header[8] = { 'M', 'T', 'r', 'k', 0, 0, 0, 0 }; /* MTrk - MIDI Track Header */
+
+  g_byte_array_append(data, header, 8);
+
+  return data;
+}
+
+
+/* Terminate a track with an end of track event, backpatch the chunk
+ * length and hand the bytes over to a buffer without copying them */
+static GstBuffer *
+finish_track_chunk(GstMusicXml2Midi * filter, GByteArray * data)
+{
+  guint8 end_data[4] = { 0x00, 0xff, 0x2f, 0x00 }; /* End of track event */
+  GstBuffer *buf = gst_buffer_new();
+  guint32 length;
+
+  count_events(filter, 1);
+  g_byte_array_append(data, end_data, 4);
+
+  length = g_htonl(data->len - 8);
+  memcpy(data->data + 4, &length, 4);
+
+  GST_BUFFER_SIZE(buf) = data->len;
+  GST_BUFFER_DATA(buf) = g_byte_array_free(data, FALSE);
+  GST_BUFFER_MALLOCDATA(buf) = GST_BUFFER_DATA(buf);
 
   return buf;
 }
@@ -373,18 +710,20 @@ process_score_part(GstMusicXml2Midi * filter, xmlNode * node)
   t->midi_instrument = 0;
   t->divisions = 1;
   t->rest = 0;
+  t->events = NULL;
+  t->num_events = 0;
   filter->num_tracks++;
   t->xml_id = xmlGetProp(node, (xmlChar *) "id");
   t->next = NULL;
 
   while (child_node != NULL) {
-    if (xmlStrEqual(child_node->name, (xmlChar *) "midi-instrument")) {
+    if (IS_NAMED(child_node, NAME_MIDI_INSTRUMENT)) {
       midi_child = child_node->children;
       while (midi_child != NULL) {
-        if (xmlStrEqual(midi_child->name, (xmlChar *) "midi-channel")) {
-          t->midi_channel = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, midi_child->xmlChildrenNode, 1));
-        } else if (xmlStrEqual(midi_child->name, (xmlChar *) "midi-program")) {
-          t->midi_instrument = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, midi_child->xmlChildrenNode, 1));
+        if (IS_NAMED(midi_child, NAME_MIDI_CHANNEL)) {
+          t->midi_channel = get_node_int(filter, midi_child);
+        } else if (IS_NAMED(midi_child, NAME_MIDI_PROGRAM)) {
+          t->midi_instrument = get_node_int(filter, midi_child);
         }
         midi_child = midi_child->next;
       }
@@ -404,56 +743,54 @@ process_score_part(GstMusicXml2Midi * filter, xmlNode * node)
 }
 
 
-static GstBuffer *
-process_attributes(GstMusicXml2Midi * filter, xmlNode * node, Track * t)
+static gboolean
+process_attributes(GstMusicXml2Midi * filter, xmlNode * node, Track * t, GByteArray * data)
 {
   xmlNode *child_node = node->children;
-  GstBuffer *buf = NULL;
-  GstBuffer *tmp_buf;
+  gboolean written = FALSE;
 
   while (child_node != NULL) {
-    tmp_buf = NULL;
-            
-    if (xmlStrEqual(child_node->name, (xmlChar *) "time")) {
-      tmp_buf = process_time(filter, child_node);
-    } else if (xmlStrEqual(child_node->name, (xmlChar *) "key")) {
-      tmp_buf = process_key(filter, child_node);
-    } else if (xmlStrEqual(child_node->name, (xmlChar *) "divisions")) {
-      t->divisions = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, child_node->xmlChildrenNode, 1));
-    }
-
-    if (buf == NULL) {
-      buf = tmp_buf;
-    } else if (tmp_buf != NULL) {
-      buf = gst_buffer_join(buf, tmp_buf);
+    if (IS_NAMED(child_node, NAME_TIME)) {
+      written |= process_time(filter, child_node, data);
+    } else if (IS_NAMED(child_node, NAME_KEY)) {
+      written |= process_key(filter, child_node, data);
+    } else if (IS_NAMED(child_node, NAME_DIVISIONS)) {
+      int divisions = get_node_int(filter, child_node);
+
+      /* Every delta time is divided by this */
+      if (divisions <= 0) {
+        filter->reject_reason = "Score has a divisions value that is not a positive number";
+        break;
+      }
+      t->divisions = divisions;
     }
 
     child_node = child_node->next;
   }
 
-  return buf;
+  return written;
 }
 
 
-static GstBuffer *
-process_time(GstMusicXml2Midi * filter, xmlNode * node)
+static gboolean
+process_time(GstMusicXml2Midi * filter, xmlNode * node, GByteArray * buf)
 {
   xmlNode *child_node = node->children;
-  GstBuffer *buf = gst_buffer_new_and_alloc(8);
-  guint8 *data = GST_BUFFER_DATA(buf);
+  guint8 data[8];
   guint8 beats = 0;
   guint8 beat_type = 0;
 
   while (child_node != NULL) {
-    if (xmlStrEqual(child_node->name, (xmlChar *) "beats")) {
-      beats = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, child_node->xmlChildrenNode, 1));
-    } else if (xmlStrEqual(child_node->name, (xmlChar *) "beat-type")) {
-      beat_type = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, child_node->xmlChildrenNode, 1));
+    if (IS_NAMED(child_node, NAME_BEATS)) {
+      beats = get_node_int(filter, child_node);
+    } else if (IS_NAMED(child_node, NAME_BEAT_TYPE)) {
+      beat_type = get_node_int(filter, child_node);
     }
     child_node = child_node->next;
   }
 
   if(beats != 0 && beat_type != 0) {
+    count_events(filter, 1);
     data[0] = 0x00; /* Delta time */
     data[1] = 0xff; /* Meta event */
     data[2] = 0x58; /* Set time signature */
@@ -462,62 +799,62 @@ process_time(GstMusicXml2Midi * filter, xmlNode * node)
     data[5] = (guint8) sqrt(beat_type);
     data[6] = 24; /* Metronome */
     data[7] = 8; /* 32nds */
-    return buf;
+    g_byte_array_append(buf, data, 8);
+    return TRUE;
   } else {
-    return NULL;
+    return FALSE;
   }
 }
 
 
-static GstBuffer *
-process_key(GstMusicXml2Midi * filter, xmlNode * node)
+static gboolean
+process_key(GstMusicXml2Midi * filter, xmlNode * node, GByteArray * buf)
 {
   xmlNode *child_node = node->children;
-  GstBuffer *buf = gst_buffer_new_and_alloc(6);
-  guint8 *data = GST_BUFFER_DATA(buf);
+  guint8 data[6];
   guint8 fifths = 0;
 
   while (child_node != NULL) {
-    if (xmlStrEqual(child_node->name, (xmlChar *) "fifths")) {
-      fifths = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, child_node->xmlChildrenNode, 1));
+    if (IS_NAMED(child_node, NAME_FIFTHS)) {
+      fifths = get_node_int(filter, child_node);
     }
     child_node = child_node->next;
   }
 
+  count_events(filter, 1);
   data[0] = 0x00; /* Delta time */
   data[1] = 0xff; /* Meta event */
   data[2] = 0x59; /* Set key signature */
   data[3] = 2; /* Event data length */
   data[4] = fifths;
   data[5] = 0; /* Scale */
+  g_byte_array_append(buf, data, 6);
 
-  return buf;
+  return TRUE;
 }
 
 
-static GstBuffer *
-process_note(GstMusicXml2Midi * filter, xmlNode * node, Track * track)
+static void
+process_note(GstMusicXml2Midi * filter, xmlNode * node, Track * track, GByteArray * buf)
 {
   xmlNode *child_node = node->children;
   xmlNode *pitch_child;
-  GstBuffer *buf = gst_buffer_new_and_alloc(3);
-  GstBuffer *off_buf = gst_buffer_new_and_alloc(3);
-  guint8 *data = GST_BUFFER_DATA(buf);
-  guint8 *off_data = GST_BUFFER_DATA(off_buf);
+  guint8 data[3];
+  guint8 off_data[3];
   guint8 duration = 0, pitch = 0, step = 0, octave = 0;
   gint8 alter = 0;
   gboolean rest = FALSE;
 
   while (child_node != NULL) {
-    if (xmlStrEqual(child_node->name, (xmlChar *) "duration")) {
-      duration = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, child_node->xmlChildrenNode, 1));
-    } else if (xmlStrEqual(child_node->name, (xmlChar *) "rest")) {
+    if (IS_NAMED(child_node, NAME_DURATION)) {
+      duration = get_node_int(filter, child_node);
+    } else if (IS_NAMED(child_node, NAME_REST)) {
       rest = TRUE;
-    } else if (xmlStrEqual(child_node->name, (xmlChar *) "pitch")) {
+    } else if (IS_NAMED(child_node, NAME_PITCH)) {
       pitch_child = child_node->children;
       while (pitch_child != NULL) {
-        if (xmlStrEqual(pitch_child->name, (xmlChar *) "step")) {
-          step = (guint8) xmlNodeListGetString(filter->ctxt->myDoc, pitch_child->xmlChildrenNode, 1)[0]; 
+        if (IS_NAMED(pitch_child, NAME_STEP)) {
+          step = get_node_char(filter, pitch_child);
           if (step < 72) {
             /* ASCII offset to capital C */
             step -= 67;
@@ -529,10 +866,10 @@ process_note(GstMusicXml2Midi * filter, xmlNode * node, Track * track)
           if (step > 5) { /* E */
             step--;
           }
-        } else if (xmlStrEqual(pitch_child->name, (xmlChar *) "octave")) {
-          octave = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, pitch_child->xmlChildrenNode, 1));
-        } else if (xmlStrEqual(pitch_child->name, (xmlChar *) "alter")) {
-          alter = atoi((char *) xmlNodeListGetString(filter->ctxt->myDoc, pitch_child->xmlChildrenNode, 1));
+        } else if (IS_NAMED(pitch_child, NAME_OCTAVE)) {
+          octave = get_node_int(filter, pitch_child);
+        } else if (IS_NAMED(pitch_child, NAME_ALTER)) {
+          alter = get_node_int(filter, pitch_child);
         }
         pitch_child = pitch_child->next;
       }
@@ -544,29 +881,29 @@ process_note(GstMusicXml2Midi * filter, xmlNode * node, Track * track)
   if (rest) {
     track->rest += duration;  
   } else {
+    count_events(filter, 2);
     /* Note on */
     data[0] = 0x90 | track->midi_channel;
     data[1] = pitch;
     data[2] = track->volume;
-    buf = gst_buffer_join(get_vlv(track->rest * TIME_DIVISION / track->divisions), buf);
+    append_vlv(buf, track->rest * TIME_DIVISION / track->divisions);
+    g_byte_array_append(buf, data, 3);
     track->rest = 0;
 
     /* Note off */
     off_data[0] = 0x80 | track->midi_channel;
     off_data[1] = pitch;
     off_data[2] = 0;
-    off_buf = gst_buffer_join(get_vlv(duration * TIME_DIVISION / track->divisions), off_buf);
-    buf = gst_buffer_join(buf, off_buf);
+    append_vlv(buf, duration * TIME_DIVISION / track->divisions);
+    g_byte_array_append(buf, off_data, 3);
   }
-
-  return buf;
 }
 
 
-/* Return a buffer containing a variable length value (vlv)
- * suitable for use as delta times */
-static GstBuffer * 
-get_vlv (guint32 val)
+/* Append a variable length value (vlv) suitable for use as
+ * delta times */
+static void
+append_vlv (GByteArray * buf, guint32 val)
 {
   // Calculate how many bytes we need
   int len = 1;
@@ -574,8 +911,7 @@ get_vlv (guint32 val)
     len++;
   }
 
-  GstBuffer *buf = gst_buffer_new_and_alloc(len);
-  guint8 *data = GST_BUFFER_DATA(buf);
+  guint8 data[5];
   int i;
   
   for(i = len - 1; i > -1; i--) {
@@ -586,8 +922,197 @@ get_vlv (guint32 val)
     }
   }
 
-  return buf;
-} 
+  g_byte_array_append(buf, data, len);
+}
+
+
+/* Return the text content of an element as an integer */
+static int
+get_node_int (GstMusicXml2Midi * filter, xmlNode * node)
+{
+  xmlChar *str = xmlNodeListGetString(filter->ctxt->myDoc, node->xmlChildrenNode, 1);
+  int val = 0;
+
+  if (str != NULL) {
+    val = atoi((char *) str);
+    xmlFree(str);
+  }
+  return val;
+}
+
+
+/* Return the first character of the text content of an element */
+static guint8
+get_node_char (GstMusicXml2Midi * filter, xmlNode * node)
+{
+  xmlChar *str = xmlNodeListGetString(filter->ctxt->myDoc, node->xmlChildrenNode, 1);
+  guint8 val = 0;
+
+  if (str != NULL) {
+    val = (guint8) str[0];
+    xmlFree(str);
+  }
+  return val;
+}
+
+
+/* Account for n more MIDI events, rejecting the score once it
+ * produces more than max-events */
+static void
+count_events (GstMusicXml2Midi * filter, guint n)
+{
+  filter->num_events += n;
+  if (filter->max_events > 0 && filter->num_events > filter->max_events) {
+    filter->reject_reason = "Score produces more MIDI events than max-events allows";
+  }
+}
+
+
+/* Account for n more nodes in the tree being built, stopping the
+ * parser once there are more than max-dom-nodes */
+static gboolean
+count_dom_nodes (xmlParserCtxtPtr ctxt, guint n)
+{
+  GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (ctxt->_private);
+
+  filter->dom_nodes += n;
+  if (filter->max_dom_nodes > 0 && filter->dom_nodes > filter->max_dom_nodes) {
+    filter->reject_reason = "Document contains more nodes than max-dom-nodes allows";
+    xmlStopParser(ctxt);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+/* SAX callbacks wrapping the default tree builder so limits are
+ * enforced while chunks are parsed rather than after the fact */
+static void
+sax_start_element_ns (void *ctx, const xmlChar * localname,
+    const xmlChar * prefix, const xmlChar * URI, int nb_namespaces,
+    const xmlChar ** namespaces, int nb_attributes, int nb_defaulted,
+    const xmlChar ** attributes)
+{
+  /* The element, its attributes and its namespace declarations */
+  if (!count_dom_nodes((xmlParserCtxtPtr) ctx, 1 + nb_attributes + nb_namespaces)) {
+    return;
+  }
+
+  xmlSAX2StartElementNs(ctx, localname, prefix, URI, nb_namespaces,
+      namespaces, nb_attributes, nb_defaulted, attributes);
+}
+
+
+/* Text may arrive in several calls for a single node, so this
+ * errs on the side of counting too many */
+static void
+sax_characters (void *ctx, const xmlChar * ch, int len)
+{
+  if (!count_dom_nodes((xmlParserCtxtPtr) ctx, 1)) {
+    return;
+  }
+
+  xmlSAX2Characters(ctx, ch, len);
+}
+
+
+static void
+sax_cdata_block (void *ctx, const xmlChar * value, int len)
+{
+  if (!count_dom_nodes((xmlParserCtxtPtr) ctx, 1)) {
+    return;
+  }
+
+  xmlSAX2CDataBlock(ctx, value, len);
+}
+
+
+static void
+sax_comment (void *ctx, const xmlChar * value)
+{
+  if (!count_dom_nodes((xmlParserCtxtPtr) ctx, 1)) {
+    return;
+  }
+
+  xmlSAX2Comment(ctx, value);
+}
+
+
+static void
+sax_processing_instruction (void *ctx, const xmlChar * target,
+    const xmlChar * data)
+{
+  if (!count_dom_nodes((xmlParserCtxtPtr) ctx, 1)) {
+    return;
+  }
+
+  xmlSAX2ProcessingInstruction(ctx, target, data);
+}
+
+
+static void
+sax_entity_decl (void *ctx, const xmlChar * name, int type,
+    const xmlChar * publicId, const xmlChar * systemId, xmlChar * content)
+{
+  xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr) ctx;
+  GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (ctxt->_private);
+
+  filter->reject_reason = "Documents declaring entities are not supported";
+  xmlStopParser(ctxt);
+}
+
+
+/* Whether the peer of pad takes a buffer list as it is. Pads without a
+ * chain_list function, and sinks without render_list, merge each group
+ * into a fresh buffer, copying even groups of a single buffer */
+static gboolean
+peer_handles_lists (GstPad * pad)
+{
+  GstPad *peer = gst_pad_get_peer (pad);
+  GstElement *parent;
+  gboolean handles = FALSE;
+
+  if (peer == NULL) {
+    return FALSE;
+  }
+
+  if (GST_PAD_CHAINLISTFUNC (peer) != NULL) {
+    handles = TRUE;
+    parent = gst_pad_get_parent_element (peer);
+    if (parent != NULL) {
+      if (GST_IS_BASE_SINK (parent) &&
+          GST_BASE_SINK_GET_CLASS (parent)->render_list == NULL) {
+        handles = FALSE;
+      }
+      gst_object_unref (parent);
+    }
+  }
+  gst_object_unref (peer);
+
+  return handles;
+}
+
+
+/* Push each buffer of the list on its own, consuming the list */
+static GstFlowReturn
+push_list_buffers (GstPad * pad, GstBufferList * list)
+{
+  GstBufferListIterator *it = gst_buffer_list_iterate (list);
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstBuffer *buf;
+
+  while (ret == GST_FLOW_OK && gst_buffer_list_iterator_next_group (it)) {
+    while (ret == GST_FLOW_OK && gst_buffer_list_iterator_next (it) != NULL) {
+      /* Steal the buffer so downstream holds its only reference */
+      buf = gst_buffer_list_iterator_steal (it);
+      ret = gst_pad_push (pad, buf);
+    }
+  }
+  gst_buffer_list_iterator_free (it);
+  gst_buffer_list_unref (list);
+
+  return ret;
+}
 
 
 static gboolean
@@ -595,9 +1120,39 @@ gst_musicxml2midi_sink_event (GstPad * pad, GstEvent * event)
 {
   if (GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
     GstMusicXml2Midi *filter = GST_MUSICXML2MIDI (gst_pad_get_parent (pad));
-    xmlNode *root = xmlDocGetRootElement(filter->ctxt->myDoc);
-    GstBuffer *buf = process_element(filter, root);
-    gst_pad_push (filter->srcpad, buf);
+
+    /* Rejected input has already been reported from the chain function */
+    if (!filter->reject_reason) {
+      xmlNode *root = xmlDocGetRootElement(filter->ctxt->myDoc);
+      GstBufferList *list = gst_buffer_list_new();
+      GstBufferListIterator *it = gst_buffer_list_iterate(list);
+      guint n_buffers;
+
+      TRACE2(convert_start, filter, filter->document_bytes);
+      n_buffers = process_element(filter, root, it);
+      TRACE2(convert_end, filter, filter->num_events);
+
+      gst_buffer_list_iterator_free(it);
+
+      if (filter->reject_reason) {
+        GST_ELEMENT_ERROR (filter, STREAM, FAILED, (NULL),
+            ("%s (%u events)", filter->reject_reason, filter->num_events));
+        gst_buffer_list_unref (list);
+      } else if (n_buffers > 0) {
+        GstFlowReturn ret;
+
+        TRACE2(push_start, filter, n_buffers);
+        if (peer_handles_lists (filter->srcpad)) {
+          ret = gst_pad_push_list (filter->srcpad, list);
+        } else {
+          ret = push_list_buffers (filter->srcpad, list);
+        }
+        TRACE2(push_end, filter, ret);
+      } else {
+        gst_buffer_list_unref (list);
+      }
+    }
+    gst_object_unref (filter);
   } 
   return gst_pad_event_default (pad, event);
 }
@@ -610,14 +1165,48 @@ static GstFlowReturn
 gst_musicxml2midi_chain (GstPad * pad, GstBuffer * buf)
 {
   GstMusicXml2Midi *filter;
-  xmlNode *root_element = NULL;
+  GstFlowReturn ret = GST_FLOW_OK;
 
   filter = GST_MUSICXML2MIDI (gst_pad_get_parent (pad));
 
-  xmlParseChunk(filter->ctxt, (char *) buf->data, buf->size, 0);
-  root_element = xmlDocGetRootElement(filter->ctxt->myDoc);
+  if (filter->reject_reason) {
+    ret = GST_FLOW_ERROR;
+    goto done;
+  }
 
-  return GST_FLOW_OK;
+  TRACE2(chunk_received, filter, GST_BUFFER_SIZE(buf));
+
+  filter->document_bytes += GST_BUFFER_SIZE(buf);
+  if (filter->max_document_bytes > 0 &&
+      filter->document_bytes > filter->max_document_bytes) {
+    filter->reject_reason = "Document is larger than max-document-bytes allows";
+  } else {
+    xmlParseChunk(filter->ctxt, (char *) GST_BUFFER_DATA(buf), GST_BUFFER_SIZE(buf), 0);
+    TRACE3(chunk_parsed, filter, GST_BUFFER_SIZE(buf), filter->dom_nodes);
+  }
+
+  if (filter->reject_reason) {
+    GST_ELEMENT_ERROR (filter, STREAM, FAILED, (NULL),
+        ("%s (%" G_GUINT64_FORMAT " bytes, %u nodes)", filter->reject_reason,
+            filter->document_bytes, filter->dom_nodes));
+
+    /* Release whatever was built so far straight away, the parser
+     * must be stopped first as its node stack points in to the tree */
+    xmlStopParser(filter->ctxt);
+    if (filter->ctxt->myDoc != NULL) {
+      xmlFreeDoc(filter->ctxt->myDoc);
+      filter->ctxt->myDoc = NULL;
+      filter->ctxt->node = NULL;
+      filter->ctxt->nodeNr = 0;
+    }
+    ret = GST_FLOW_ERROR;
+  }
+
+done:
+  gst_buffer_unref (buf);
+  gst_object_unref (filter);
+
+  return ret;
 
 //  return gst_pad_push (filter->srcpad, buf);
 }
@@ -636,6 +1225,19 @@ musicxml2midi_init (GstPlugin * musicxml2midi)
   GST_DEBUG_CATEGORY_INIT (gst_musicxml2midi_debug, "musicxml2midi",
       0, " musicxml2midi");
 
+  /* libxml2 must be initialised once, before any thread creates a parser */
+  xmlInitParser();
+
+  if (musicxml2midi_dict == NULL) {
+    int i;
+
+    musicxml2midi_dict = xmlDictCreate();
+    for (i = 0; i < N_NAMES; i++) {
+      musicxml2midi_interned[i] = xmlDictLookup(musicxml2midi_dict,
+          BAD_CAST musicxml2midi_names[i], -1);
+    }
+  }
+
   return gst_element_register (musicxml2midi, "musicxml2midi", GST_RANK_MARGINAL,
       GST_TYPE_MUSICXML2MIDI);
 }
@@ -78,6 +78,18 @@ struct _GstMusicXml2Midi
   int num_tracks;
 
   xmlParserCtxtPtr ctxt;
+
+  /* Limits on hostile input, 0 means unlimited */
+  guint64 max_document_bytes;
+  guint max_dom_nodes;
+  guint max_events;
+
+  guint64 document_bytes;
+  guint dom_nodes;
+  guint num_events;
+
+  /* Set once the input has been rejected, explains why */
+  const gchar *reject_reason;
 };
 
 struct _GstMusicXml2MidiClass 
@@ -92,8 +104,10 @@ struct _Track
   guint8 midi_channel;
   guint8 midi_instrument;
   guint8 volume;
-  guint8 divisions;
+  guint32 divisions;
   guint8 rest;
+  GByteArray *events; /* Pending MTrk chunk of a score-timewise part */
+  guint num_events; /* Events in that chunk, for tracing */
   Track *next;
 };
 
@@ -0,0 +1,138 @@
+/*
+ * GStreamer
+ * Copyright (C) 2009 Michael Sheldon <mike@mikeasoft.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Checks that each of max-document-bytes, max-dom-nodes and max-events
+ * rejects a score that is over the limit with a STREAM/FAILED error,
+ * and that the element converts normally again once it has been
+ * taken back to READY with the limit lifted.
+ */
+
+#include <gst/gst.h>
+
+#ifndef SAMPLES_DIR
+#  define SAMPLES_DIR "samples"
+#endif
+
+/* Play the pipeline until EOS or an error, returns the error if any */
+static GError *
+run (GstElement * pipeline)
+{
+  GstBus *bus;
+  GstMessage *msg;
+  GError *error = NULL;
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  bus = gst_element_get_bus (pipeline);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gst_message_parse_error (msg, &error, NULL);
+  }
+  gst_message_unref (msg);
+
+  gst_element_set_state (pipeline, GST_STATE_READY);
+
+  /* Drop anything else the run posted, such as the source's own
+   * internal data flow error following a rejection */
+  gst_bus_set_flushing (bus, TRUE);
+  gst_bus_set_flushing (bus, FALSE);
+  gst_object_unref (bus);
+
+  return error;
+}
+
+static gboolean
+check_limit (const gchar * property, guint64 value)
+{
+  gchar *path, *desc;
+  GstElement *pipeline, *conv;
+  GError *error;
+  gboolean ok = TRUE;
+
+  path = g_build_filename (SAMPLES_DIR, "BrookeWestSample.xml", NULL);
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! musicxml2midi name=conv "
+      "! fakesink", path);
+  pipeline = gst_parse_launch (desc, NULL);
+  g_free (desc);
+  g_free (path);
+  if (pipeline == NULL) {
+    g_printerr ("%s: could not create pipeline\n", property);
+    return FALSE;
+  }
+  conv = gst_bin_get_by_name (GST_BIN (pipeline), "conv");
+
+  if (g_str_equal (property, "max-document-bytes")) {
+    g_object_set (conv, property, value, NULL);
+  } else {
+    g_object_set (conv, property, (guint) value, NULL);
+  }
+
+  error = run (pipeline);
+  if (error == NULL) {
+    g_printerr ("%s=%" G_GUINT64_FORMAT ": score was not rejected\n",
+        property, value);
+    ok = FALSE;
+  } else {
+    if (error->domain != GST_STREAM_ERROR ||
+        error->code != GST_STREAM_ERROR_FAILED) {
+      g_printerr ("%s: expected a STREAM/FAILED error, got: %s\n", property,
+          error->message);
+      ok = FALSE;
+    }
+    g_error_free (error);
+  }
+
+  /* Lifting the limit must make the same element usable again */
+  if (g_str_equal (property, "max-document-bytes")) {
+    g_object_set (conv, property, (guint64) 0, NULL);
+  } else {
+    g_object_set (conv, property, (guint) 0, NULL);
+  }
+
+  error = run (pipeline);
+  if (error != NULL) {
+    g_printerr ("%s: element failed after being reset: %s\n", property,
+        error->message);
+    g_error_free (error);
+    ok = FALSE;
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (conv);
+  gst_object_unref (pipeline);
+
+  g_print ("%s: %s\n", property, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+int
+main (int argc, char *argv[])
+{
+  gboolean ok = TRUE;
+
+  gst_init (&argc, &argv);
+
+  ok &= check_limit ("max-document-bytes", 1000);
+  ok &= check_limit ("max-dom-nodes", 50);
+  ok &= check_limit ("max-events", 10);
+
+  return ok ? 0 : 1;
+}
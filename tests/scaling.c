@@ -0,0 +1,171 @@
+/*
+ * GStreamer
+ * Copyright (C) 2009 Michael Sheldon <mike@mikeasoft.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Runs N filesrc ! musicxml2midi ! fakesink pipelines in parallel threads
+ * over the sample scores, for N = 1, 2, 4, ... up to the number of cores,
+ * and reports how conversion throughput scales with N.
+ *
+ * Usage: scaling [max-threads [iterations]]
+ */
+
+#include <gst/gst.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef SAMPLES_DIR
+#  define SAMPLES_DIR "samples"
+#endif
+
+static const gchar *samples[] = {
+  "c.xml", "keysignature.xml", "twovoices.xml", "twovoices-timewise.xml",
+  "BrookeWestSample.xml", NULL
+};
+
+static gint iterations = 4;
+static volatile gint failures = 0;
+
+/* Convert one file, returns FALSE if the pipeline posted an error */
+static gboolean
+convert (const gchar * path)
+{
+  gchar *desc;
+  GstElement *pipeline;
+  GstBus *bus;
+  GstMessage *msg;
+  GError *error = NULL;
+  gboolean ok = FALSE;
+
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! musicxml2midi ! fakesink",
+      path);
+  pipeline = gst_parse_launch (desc, &error);
+  g_free (desc);
+  if (pipeline == NULL) {
+    g_printerr ("Could not create pipeline: %s\n", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  bus = gst_element_get_bus (pipeline);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS) {
+    ok = TRUE;
+  } else {
+    gst_message_parse_error (msg, &error, NULL);
+    g_printerr ("%s: %s\n", path, error->message);
+    g_error_free (error);
+  }
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+
+  return ok;
+}
+
+static gpointer
+worker (gpointer data)
+{
+  gint i;
+  const gchar **sample;
+  gchar *path;
+
+  for (i = 0; i < iterations; i++) {
+    for (sample = samples; *sample != NULL; sample++) {
+      path = g_build_filename (SAMPLES_DIR, *sample, NULL);
+      if (!convert (path)) {
+        g_atomic_int_inc (&failures);
+      }
+      g_free (path);
+    }
+  }
+
+  return NULL;
+}
+
+/* Run n workers at once, returns conversions per second */
+static gdouble
+run (gint n)
+{
+  GThread **threads = g_new0 (GThread *, n);
+  GTimer *timer = g_timer_new ();
+  gdouble elapsed;
+  gint i;
+
+  for (i = 0; i < n; i++) {
+    threads[i] = g_thread_create (worker, NULL, TRUE, NULL);
+  }
+  for (i = 0; i < n; i++) {
+    g_thread_join (threads[i]);
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+  g_free (threads);
+
+  return (n * iterations * (G_N_ELEMENTS (samples) - 1)) / elapsed;
+}
+
+int
+main (int argc, char *argv[])
+{
+  gint max_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  gint n;
+  gdouble rate, base_rate = 0;
+
+  gst_init (&argc, &argv);
+
+  if (argc > 1) {
+    max_threads = atoi (argv[1]);
+  }
+  if (argc > 2) {
+    iterations = atoi (argv[2]);
+  }
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  /* Warm up the registry and the plugin before timing anything */
+  worker (NULL);
+  if (failures > 0) {
+    return 1;
+  }
+
+  g_print ("threads  conversions/s  speedup\n");
+  n = 1;
+  while (TRUE) {
+    rate = run (n);
+    if (base_rate == 0) {
+      base_rate = rate;
+    }
+    g_print ("%7d  %13.1f  %7.2f\n", n, rate, rate / base_rate);
+
+    if (n == max_threads) {
+      break;
+    }
+    n = MIN (n * 2, max_threads);
+  }
+
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * GStreamer
+ * Copyright (C) 2009 Michael Sheldon <mike@mikeasoft.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Converts twovoices.xml and its score-timewise transposition
+ * twovoices-timewise.xml and checks the resulting MIDI files are
+ * byte for byte identical.
+ */
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef SAMPLES_DIR
+#  define SAMPLES_DIR "samples"
+#endif
+
+/* Convert a sample to MIDI, returns the file contents or NULL */
+static gchar *
+convert (const gchar * sample, gsize * length)
+{
+  gchar *path, *out_path, *desc;
+  gchar *contents = NULL;
+  GstElement *pipeline;
+  GstBus *bus;
+  GstMessage *msg;
+  GError *error = NULL;
+  gboolean failed = FALSE;
+  gint fd;
+
+  fd = g_file_open_tmp ("musicxml2midi-XXXXXX.mid", &out_path, &error);
+  if (fd < 0) {
+    g_printerr ("Could not create a temporary file: %s\n", error->message);
+    g_error_free (error);
+    return NULL;
+  }
+  close (fd);
+
+  path = g_build_filename (SAMPLES_DIR, sample, NULL);
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! musicxml2midi "
+      "! filesink location=\"%s\"", path, out_path);
+  pipeline = gst_parse_launch (desc, NULL);
+  g_free (desc);
+  g_free (path);
+  if (pipeline == NULL) {
+    g_printerr ("%s: could not create pipeline\n", sample);
+    goto done;
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  bus = gst_element_get_bus (pipeline);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gst_message_parse_error (msg, &error, NULL);
+    g_printerr ("%s: %s\n", sample, error->message);
+    g_error_free (error);
+    failed = TRUE;
+  }
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+
+  /* filesink only closes the file on the way back to NULL */
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+
+  if (!failed && !g_file_get_contents (out_path, &contents, length, NULL)) {
+    g_printerr ("%s: could not read %s\n", sample, out_path);
+  }
+
+done:
+  g_unlink (out_path);
+  g_free (out_path);
+
+  return contents;
+}
+
+int
+main (int argc, char *argv[])
+{
+  gchar *partwise, *timewise;
+  gsize partwise_len = 0, timewise_len = 0;
+  gboolean ok;
+
+  gst_init (&argc, &argv);
+
+  partwise = convert ("twovoices.xml", &partwise_len);
+  timewise = convert ("twovoices-timewise.xml", &timewise_len);
+
+  ok = partwise != NULL && timewise != NULL && partwise_len > 0 &&
+      partwise_len == timewise_len &&
+      memcmp (partwise, timewise, partwise_len) == 0;
+
+  if (ok) {
+    g_print ("timewise output matches partwise (%" G_GSIZE_FORMAT " bytes)\n",
+        partwise_len);
+  } else {
+    g_printerr ("timewise output differs from partwise (%" G_GSIZE_FORMAT
+        " vs %" G_GSIZE_FORMAT " bytes)\n", timewise_len, partwise_len);
+  }
+
+  g_free (partwise);
+  g_free (timewise);
+
+  return ok ? 0 : 1;
+}